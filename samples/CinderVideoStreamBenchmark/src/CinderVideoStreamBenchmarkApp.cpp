@@ -0,0 +1,326 @@
+/*
+ CinderVideoStreamBenchmarkApp.cpp
+
+ Copyright (c) 2015 onewaytheater.us
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy of
+ this software and associated documentation files (the "Software"), to deal in
+ the Software without restriction, including without limitation the rights to
+ use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ of the Software, and to permit persons to whom the Software is furnished to do
+ so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+
+ Fans a synthetic stream out to many local subscribers and plots the send
+ throughput of CinderVideoStreamShardedServer against the number of shards,
+ compares default thread placement with every stage and the frame pool kept
+ on NUMA node 0 (huge pages, pinned shards), then measures frame latency and
+ delivered frame rate of a streaming client behind
+ CinderVideoStreamImpairmentProxy for a few network profiles.
+ */
+
+#include "cinder/app/App.h"
+#include "cinder/app/RendererGl.h"
+#include "cinder/gl/gl.h"
+#include "ConcurrentQueue.h"
+#include "CinderVideoStreamClient.h"
+#include "CinderVideoStreamShardedServer.h"
+#include "CinderVideoStreamImpairmentProxy.h"
+#include "CinderVideoStreamPlacement.h"
+
+using namespace ci;
+using namespace ci::app;
+using namespace std;
+
+static const int WIDTH = 1280, HEIGHT = 720;
+static const int SUBSCRIBERS = 200;
+static const double SECONDS_PER_RUN = 5.0;
+static const double PUBLISH_FPS = 60.0;
+static const unsigned short PORT = 3334;
+static const unsigned short PROXY_PORT = 3335;
+static const size_t ENCODED_FRAME_SIZE = 100000;  // typical 720p JPEG
+
+class CinderVideoStreamBenchmarkApp : public App {
+ public:
+	void setup();
+	void draw();
+    void shutdown();
+
+ private:
+    struct Result {
+        size_t shards;
+        bool tuned;
+        double megabytesPerSecond;
+        double framesPerSecond;
+    };
+    struct LatencyResult {
+        std::string profile;
+        double framesPerSecond;
+        double medianMilliseconds;
+        double worstMilliseconds;
+    };
+
+    void threadLoop();
+    Result measure(size_t shards, const VideoStreamPlacement* placement = nullptr);
+    LatencyResult measureLatency(const std::string& profile, const VideoStreamImpairment& impairment);
+
+    std::shared_ptr<std::thread> mBenchmarkThreadRef;
+    std::mutex mResultsMutex;
+    std::vector<Result> mResults;
+    std::vector<LatencyResult> mLatencyResults;
+    std::string mStatus;
+    bool running;
+};
+
+// Subscribers run on their own io_service and throw away what they receive.
+static void drain(std::shared_ptr<asio::ip::tcp::socket> socket, std::shared_ptr<std::vector<uint8_t> > buffer)
+{
+    socket->async_read_some(asio::buffer(*buffer), [socket, buffer](const asio::error_code& error, size_t){
+        if (!error) drain(socket, buffer);
+    });
+}
+
+// Without a placement shard i sits on core i, every other thread floats and
+// frames come from the heap; with one, publisher, shards and subscribers run
+// on its CPUs and frames come from a huge-page pool on its node.
+CinderVideoStreamBenchmarkApp::Result CinderVideoStreamBenchmarkApp::measure(size_t shards, const VideoStreamPlacement* placement)
+{
+    ph::ConcurrentQueue<VideoStreamFrameRef> queueToServer;
+    CinderVideoStreamShardedServer server(PORT, &queueToServer, shards);
+    VideoStreamFramePoolRef pool;
+    if (placement) {
+        server.setPlacement(placement->network);
+        pool = VideoStreamFramePool::create(WIDTH * HEIGHT * 3, 8, placement->capture.numaNode, placement->hugePages);
+        server.setFramePool(pool);
+    }
+    std::thread serverThread(std::bind(&CinderVideoStreamShardedServer::run, &server));
+
+    asio::io_service clients;
+    std::vector<std::shared_ptr<asio::ip::tcp::socket> > sockets;
+    asio::ip::tcp::endpoint endpoint(asio::ip::address_v4::loopback(), PORT);
+    for (int i = 0; i < SUBSCRIBERS; i++) {
+        std::shared_ptr<asio::ip::tcp::socket> socket(new asio::ip::tcp::socket(clients));
+        socket->connect(endpoint);
+        drain(socket, std::shared_ptr<std::vector<uint8_t> >(new std::vector<uint8_t>(1 << 16)));
+        sockets.push_back(socket);
+    }
+    std::vector<std::thread> clientThreads;
+    for (unsigned i = 0; i < std::max(1u, std::thread::hardware_concurrency() / 2); i++)
+        clientThreads.push_back(std::thread([&clients, placement]{
+            if (placement) placement->render.applyToCurrentThread();
+            clients.run();
+        }));
+
+    while (server.getSubscriberCount() < SUBSCRIBERS)
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    // These subscribers never say HELLO; let the server's grace period pass.
+    std::this_thread::sleep_for(std::chrono::milliseconds(2 * CinderVideoStreamShardedServer::HELLO_GRACE_MS));
+
+    // Copied once per frame, then shared by every shard and subscriber. The
+    // publisher gets its own thread so that its placement does not stick to
+    // the benchmark thread.
+    std::vector<uint8_t> image(WIDTH * HEIGHT * 3, 0x80);
+    uint64_t startBytes = server.getBytesSent(), startFrames = server.getFramesSent();
+    double elapsed = 0;
+    std::thread publisher([&]{
+        if (placement) placement->capture.applyToCurrentThread();
+        auto start = std::chrono::steady_clock::now();
+        auto interval = std::chrono::duration<double>(1.0 / PUBLISH_FPS);
+        uint32_t frameId = 0;
+        VideoStreamFrameHeader info;
+        while (std::chrono::steady_clock::now() - start < std::chrono::duration<double>(SECONDS_PER_RUN)) {
+            info.frameId = frameId++;
+            queueToServer.push(pool ? pool->createFrame(image.data(), image.size(), info)
+                                    : VideoStreamFrame::create(image.data(), image.size(), info));
+            std::this_thread::sleep_until(start + frameId * interval);
+        }
+        elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    });
+    publisher.join();
+
+    Result result;
+    result.shards = shards;
+    result.tuned = placement != nullptr;
+    result.megabytesPerSecond = (server.getBytesSent() - startBytes) / elapsed / 1.0e6;
+    result.framesPerSecond = (server.getFramesSent() - startFrames) / elapsed;
+
+    server.stop();
+    serverThread.join();
+    for (auto& socket : sockets) {
+        asio::error_code e;
+        socket->close(e);
+    }
+    clients.stop();
+    for (auto& thread : clientThreads) thread.join();
+    return result;
+}
+
+// Publisher -> CinderVideoStreamShardedServer -> impairment proxy -> streaming client.
+CinderVideoStreamBenchmarkApp::LatencyResult CinderVideoStreamBenchmarkApp::measureLatency(const std::string& profile, const VideoStreamImpairment& impairment)
+{
+    ph::ConcurrentQueue<VideoStreamFrameRef> queueToServer;
+    CinderVideoStreamShardedServer server(PORT, &queueToServer, 1);
+    std::thread serverThread(std::bind(&CinderVideoStreamShardedServer::run, &server));
+    CinderVideoStreamImpairmentProxy proxy(PROXY_PORT, "127.0.0.1", std::to_string(PORT), impairment);
+    std::thread proxyThread(std::bind(&CinderVideoStreamImpairmentProxy::run, &proxy));
+
+    ph::ConcurrentQueue<VideoStreamFrameRef> queueFromServer;
+    std::string clientStatus;
+    CinderVideoStreamClient<uint8_t> client("127.0.0.1", std::to_string(PROXY_PORT));
+    client.setup(&queueFromServer, &clientStatus);
+    std::thread clientThread(std::bind(&CinderVideoStreamClient<uint8_t>::run, &client));
+    while (server.getSubscriberCount() < 1)
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+    std::vector<uint8_t> image(ENCODED_FRAME_SIZE, 0x80);
+    std::vector<std::chrono::steady_clock::time_point> published;
+    std::vector<double> latencies;
+    auto start = std::chrono::steady_clock::now();
+    auto interval = std::chrono::duration<double>(1.0 / PUBLISH_FPS);
+    uint32_t frameId = 0;
+    while (std::chrono::steady_clock::now() - start < std::chrono::duration<double>(SECONDS_PER_RUN)) {
+        published.push_back(std::chrono::steady_clock::now());
+        queueToServer.push(VideoStreamFrame::create(image.data(), image.size(), frameId++));
+        while (std::chrono::steady_clock::now() < start + frameId * interval) {
+            VideoStreamFrameRef frame;
+            if (queueFromServer.try_pop(frame))
+                latencies.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - published[frame->getFrameId()]).count());
+            else
+                std::this_thread::sleep_for(std::chrono::microseconds(200));
+        }
+    }
+
+    LatencyResult result;
+    result.profile = profile;
+    result.framesPerSecond = latencies.size() / SECONDS_PER_RUN;
+    std::sort(latencies.begin(), latencies.end());
+    result.medianMilliseconds = latencies.empty() ? 0.0 : latencies[latencies.size() / 2];
+    result.worstMilliseconds = latencies.empty() ? 0.0 : latencies.back();
+
+    client.stop();
+    clientThread.join();
+    proxy.stop();
+    proxyThread.join();
+    server.stop();
+    serverThread.join();
+    return result;
+}
+
+void CinderVideoStreamBenchmarkApp::threadLoop()
+{
+    for (size_t shards = 1; running && shards <= std::max(1u, std::thread::hardware_concurrency()); shards *= 2) {
+        mStatus.assign("Measuring ").append(std::to_string(shards)).append(" shards");
+        try {
+            Result result = measure(shards);
+            console() << result.shards << " shards: " << result.megabytesPerSecond << " MB/sec, "
+                      << result.framesPerSecond << " frames/sec to " << SUBSCRIBERS << " subscribers" << std::endl;
+            std::lock_guard<std::mutex> lock(mResultsMutex);
+            mResults.push_back(result);
+        }
+        catch (std::exception& e) {
+            std::cerr << "Exception: " << e.what() << "\n";
+        }
+    }
+
+    // Same load, one shard per CPU of node 0, default vs tuned placement.
+    VideoStreamPlacement tuned = VideoStreamPlacement::onNode(0);
+    size_t placedShards = tuned.network.cpus.empty() ? std::max(1u, std::thread::hardware_concurrency()) : tuned.network.cpus.size();
+    for (int i = 0; running && i < 2; i++) {
+        mStatus.assign("Measuring ").append(i ? "tuned" : "default").append(" placement");
+        try {
+            Result result = measure(placedShards, i ? &tuned : nullptr);
+            console() << (i ? "tuned" : "default") << " placement, " << result.shards << " shards: " << result.megabytesPerSecond
+                      << " MB/sec, " << result.framesPerSecond << " frames/sec" << std::endl;
+            std::lock_guard<std::mutex> lock(mResultsMutex);
+            mResults.push_back(result);
+        }
+        catch (std::exception& e) {
+            std::cerr << "Exception: " << e.what() << "\n";
+        }
+    }
+
+    std::vector<std::pair<std::string, VideoStreamImpairment> > profiles;
+    profiles.push_back(std::make_pair(std::string("clean"), VideoStreamImpairment()));
+    VideoStreamImpairment venue;
+    venue.bytesPerSecond = 12.5e6;
+    venue.delay = 0.005;
+    venue.jitter = 0.01;
+    venue.lossRate = 0.01;
+    venue.reorderRate = 0.01;
+    profiles.push_back(std::make_pair(std::string("venue wifi"), venue));
+    VideoStreamImpairment remote;
+    remote.bytesPerSecond = 2.5e6;
+    remote.delay = 0.04;
+    remote.jitter = 0.02;
+    remote.lossRate = 0.02;
+    profiles.push_back(std::make_pair(std::string("remote floor"), remote));
+
+    for (size_t i = 0; running && i < profiles.size(); i++) {
+        mStatus.assign("Measuring latency: ").append(profiles[i].first);
+        try {
+            LatencyResult result = measureLatency(profiles[i].first, profiles[i].second);
+            console() << result.profile << ": " << result.framesPerSecond << " fps, median "
+                      << result.medianMilliseconds << " ms, worst " << result.worstMilliseconds << " ms" << std::endl;
+            std::lock_guard<std::mutex> lock(mResultsMutex);
+            mLatencyResults.push_back(result);
+        }
+        catch (std::exception& e) {
+            std::cerr << "Exception: " << e.what() << "\n";
+        }
+    }
+    mStatus.assign("Done");
+}
+
+void CinderVideoStreamBenchmarkApp::setup()
+{
+    running = true;
+    mStatus.assign("Starting");
+    mBenchmarkThreadRef = std::shared_ptr<std::thread>(new std::thread(std::bind(&CinderVideoStreamBenchmarkApp::threadLoop, this)));
+}
+
+void CinderVideoStreamBenchmarkApp::shutdown()
+{
+    running = false;
+    if (mBenchmarkThreadRef) mBenchmarkThreadRef->join();
+}
+
+void CinderVideoStreamBenchmarkApp::draw()
+{
+    gl::clear( Color::black() );
+
+    std::lock_guard<std::mutex> lock(mResultsMutex);
+    double peak = 1.0;
+    for (auto& result : mResults) peak = std::max(peak, result.megabytesPerSecond);
+
+    float barWidth = getWindowWidth() / (float)std::max<size_t>(mResults.size(), 1);
+    for (size_t i = 0; i < mResults.size(); i++) {
+        float height = (float)(mResults[i].megabytesPerSecond / peak) * (getWindowHeight() - 60);
+        Rectf bar(i * barWidth + 4, getWindowHeight() - 20 - height, (i + 1) * barWidth - 4, getWindowHeight() - 20);
+        gl::color( Color( 0.3f, 0.7f, 1.0f ) );
+        gl::drawSolidRect( bar );
+        gl::color( Color::white() );
+        gl::drawString(std::to_string(mResults[i].shards) + (mResults[i].tuned ? " shards tuned: " : " shards: ")
+                       + std::to_string((int)mResults[i].megabytesPerSecond) + " MB/s",
+                       vec2( bar.x1, bar.y1 - 14 ) );
+    }
+    for (size_t i = 0; i < mLatencyResults.size(); i++) {
+        const LatencyResult& result = mLatencyResults[i];
+        gl::drawString(result.profile + ": " + std::to_string((int)result.framesPerSecond) + " fps, median "
+                       + std::to_string((int)result.medianMilliseconds) + " ms, worst "
+                       + std::to_string((int)result.worstMilliseconds) + " ms",
+                       vec2( 10, 30 + 14 * i ) );
+    }
+    gl::drawString(mStatus, vec2( 10 , 10 ) );
+}
+
+CINDER_APP( CinderVideoStreamBenchmarkApp, RendererGl )
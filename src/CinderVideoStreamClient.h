@@ -29,6 +29,15 @@
 #include "asio/asio.hpp"
 #include <functional>
 #include <array>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include <deque>
+#include <thread>
+#include <vector>
+#include "CinderVideoStreamFrame.h"
+#include "CinderVideoStreamPlacement.h"
+#include "CinderVideoStreamUringTransport.h"
 //#include <boost/lexical_cast.hpp>
 
 
@@ -38,19 +47,80 @@ template <class T>
 class CinderVideoStreamClient{
     public:
 
-    CinderVideoStreamClient(std::string host, std::string service):mIOService(), mHost(host), mService(service)
+    CinderVideoStreamClient(std::string host, std::string service):mIOService(), mFrameQueue(nullptr), mMaxPayloadSize(VideoStreamFrameHeader::MAX_PAYLOAD_SIZE), mCreditWindow(2), mMaxLayers(0), mMaxFrameRate(0), mRunning(true),
+                                                                    mBackoff(0), mWaitingForFirstFrame(false), mTimeToFirstFrame(-1), mService(service), mHost(host), mNumaNode(-1), mHugePages(false), mDataSize(0), mData(nullptr)
         {
         }
     ~CinderVideoStreamClient(){
-        if (mData) delete [] mData;
     }
+    // Legacy mode: every frame is pushed as a pointer to the client's own
+    // receive buffer. That buffer is mapped by VideoStreamMemory and owned by
+    // the client; it stays valid until the client is destroyed and must not
+    // be freed by the app.
     void setup(ph::ConcurrentQueue<T*>* queueToServer, std::string* status, std::size_t dataSize){
         mQueue = queueToServer;
         mStatus = status;
+        // Keep the buffer when a client is set up again for the same stream.
+        if (mData && mDataSize == dataSize) return;
         mDataSize = dataSize;
-        mData = new T[mDataSize];
+        mDataMemory = VideoStreamMemory::allocate(sizeof(T) * mDataSize, mNumaNode, mHugePages);
+        mData = reinterpret_cast<T*>(mDataMemory.get());
+    }
+    // Where the legacy receive buffer is allocated; takes effect on the next
+    // setup() with a new data size.
+    void setMemoryPlacement(int numaNode, bool hugePages){
+        mNumaNode = numaNode;
+        mHugePages = hugePages;
+    }
+    // Streaming mode: keeps one connection to a CinderVideoStreamShardedServer
+    // open and receives every frame straight into its own shared buffer.
+    void setup(ph::ConcurrentQueue<VideoStreamFrameRef>* queueToServer, std::string* status){
+        mFrameQueue = queueToServer;
+        mStatus = status;
+    }
+    // Streaming mode receives into slots of this pool when one is free; with
+    // the io_uring backend they are read as registered buffers.
+    void setFramePool(VideoStreamFramePoolRef pool){
+        mFramePool = pool;
+    }
+    // Streaming mode drops the connection on a header announcing a larger
+    // payload instead of allocating it.
+    void setMaxPayloadSize(uint32_t bytes){
+        mMaxPayloadSize = bytes;
+    }
+    // Frames in flight plus frames waiting in the queue never exceed this; the
+    // server skips to the newest frame instead of buffering more. A frame is
+    // every slice and layer of one frame id.
+    void setCreditWindow(uint32_t frames){
+        mCreditWindow = std::max<uint32_t>(frames, 1);
+    }
+    // Only receive the first layers of a progressive stream; 0 for all.
+    void setMaxLayers(uint16_t layers){
+        mMaxLayers = layers;
+    }
+    // Asks the server for at most this many frames per second; 0 for all.
+    void setMaxFrameRate(uint16_t fps){
+        mMaxFrameRate = fps;
+    }
+    // Seconds from starting to (re)connect until the first frame arrived on
+    // the current connection, or negative while still waiting.
+    double getTimeToFirstFrame() const{
+        return mTimeToFirstFrame / 1.0e6;
+    }
+    // Makes run() return; a blocked read is woken by shutting the socket down.
+    void stop(){
+        mRunning = false;
+        std::lock_guard<std::mutex> lock(mSocketMutex);
+        if (mSocket){
+            asio::error_code e;
+            mSocket->shutdown(tcp::socket::shutdown_both, e);
+        }
     }
     void run(){
+        if (mFrameQueue){
+            runStreaming();
+            return;
+        }
         tcp::resolver resolver(mIOService);
 //        boost::array<T, 65536> temp_buffer;
         std::array<T, 65536> temp_buffer;
@@ -58,22 +128,19 @@ class CinderVideoStreamClient{
         
         size_t len, iSize;
         tcp::resolver::query query(tcp::v4(), mHost, mService);
-        while(true){
+        startWaitingForFirstFrame();
+        while(mRunning){
             try
             {
-                tcp::resolver::iterator endpoint_iterator = resolver.resolve(query);
-                tcp::resolver::iterator end;
-                
-                tcp::socket socket(mIOService);
-                asio::error_code error = asio::error::host_unreachable;
-                
-                while (error && endpoint_iterator != end)
+                std::shared_ptr<tcp::socket> socketRef(new tcp::socket(mIOService));
+                tcp::socket& socket = *socketRef;
                 {
-                    socket.close();
-                    socket.connect(*endpoint_iterator++, error);
+                    std::lock_guard<std::mutex> lock(mSocketMutex);
+                    if (!mRunning) break;
+                    mSocket = socketRef;
                 }
-                if (error)
-                    throw asio::system_error(error);
+                asio::error_code error;
+                connect(socket, resolver, query);
 
                 iSize = 0;
                 for (;;)
@@ -94,24 +161,200 @@ class CinderVideoStreamClient{
                     else if (error)
                         throw asio::system_error(error); // Some other error.
                 }
+                if (!mRunning) break;   // cut short by stop()
                 mQueue->push(mData);
+                receivedFrame();
                 (*mStatus).assign("Capturing");
             }
             catch (std::exception& e)
             {
                 (*mStatus).assign(e.what(), strlen(e.what()));
+                startWaitingForFirstFrame();
+                backoff();
             }
         }
     }
 private:
+    typedef std::chrono::steady_clock Clock;
+
+    // Resolves once and keeps the endpoints for every reconnect; a failed
+    // connect drops them so a moved server is found again.
+    void connect(tcp::socket& socket, tcp::resolver& resolver, tcp::resolver::query& query){
+        if (mEndpoints.empty()){
+            tcp::resolver::iterator it = resolver.resolve(query), end;
+            for (; it != end; ++it) mEndpoints.push_back(it->endpoint());
+        }
+        asio::error_code error = asio::error::host_not_found;
+        for (auto& endpoint : mEndpoints){
+            socket.close(error);
+            socket.connect(endpoint, error);
+            if (!error) break;
+        }
+        if (error){
+            mEndpoints.clear();
+            throw asio::system_error(error);
+        }
+    }
+    // Waits 10ms after the first failure, doubling up to one second.
+    void backoff(){
+        mBackoff = std::min(std::max(mBackoff * 2, Clock::duration(std::chrono::milliseconds(10))), Clock::duration(std::chrono::seconds(1)));
+        Clock::time_point until = Clock::now() + mBackoff;
+        while (mRunning && Clock::now() < until)
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    // Measured from the first connection attempt after starting or after
+    // losing the stream, across any retries in between.
+    void startWaitingForFirstFrame(){
+        if (mWaitingForFirstFrame) return;
+        mWaitingForFirstFrame = true;
+        mTimeToFirstFrame = -1;
+        mConnectStart = Clock::now();
+    }
+    void receivedFrame(){
+        mBackoff = Clock::duration::zero();
+        if (!mWaitingForFirstFrame) return;
+        mWaitingForFirstFrame = false;
+        mTimeToFirstFrame = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - mConnectStart).count();
+    }
+
+    void read(tcp::socket& socket, uint8_t* data, std::size_t size, int bufferIndex){
+#ifdef CINDER_VIDEOSTREAM_IO_URING
+        if (mUring){
+            mUring->read(socket.native_handle(), data, size, bufferIndex);
+            return;
+        }
+#endif
+        (void)bufferIndex;
+        asio::read(socket, asio::buffer(data, size));
+    }
+    uint32_t grantableCredits(uint32_t outstanding){
+        std::size_t used = outstanding + queuedFrames();
+        return used < mCreditWindow ? (uint32_t)(mCreditWindow - used) : 0;
+    }
+    // The queue is FIFO and only this client pushes to it, so the ids of what
+    // is still in it are the last size() ids pushed. Messages of one frame
+    // arrive back to back.
+    std::size_t queuedFrames(){
+        std::size_t size = mFrameQueue->size();
+        while (mQueuedIds.size() > size) mQueuedIds.pop_front();
+        std::size_t frames = 0;
+        for (std::size_t i = 0; i < mQueuedIds.size(); i++)
+            if (i == 0 || mQueuedIds[i] != mQueuedIds[i - 1]) frames++;
+        return frames;
+    }
+    void sendControl(tcp::socket& socket, const VideoStreamControlMessage& message){
+        std::array<uint8_t, VideoStreamControlMessage::SIZE> buffer;
+        message.write(buffer.data());
+        asio::write(socket, asio::buffer(buffer));
+    }
+    void runStreaming(){
+#ifdef CINDER_VIDEOSTREAM_IO_URING
+        try {
+            mUring.reset(new VideoStreamUringTransport(mFramePool, 8));
+        }
+        catch (std::exception&) {
+            mUring.reset();
+        }
+#endif
+        tcp::resolver resolver(mIOService);
+        tcp::resolver::query query(tcp::v4(), mHost, mService);
+        std::array<uint8_t, VideoStreamFrameHeader::SIZE> headerBuffer;
+        startWaitingForFirstFrame();
+        while(mRunning){
+            try
+            {
+                std::shared_ptr<tcp::socket> socketRef(new tcp::socket(mIOService));
+                tcp::socket& socket = *socketRef;
+                {
+                    std::lock_guard<std::mutex> lock(mSocketMutex);
+                    if (!mRunning) break;
+                    mSocket = socketRef;
+                }
+                connect(socket, resolver, query);
+                socket.set_option(tcp::no_delay(true));
+                (*mStatus).assign("Connected");
+
+                uint32_t outstanding = mCreditWindow;
+                VideoStreamControlMessage hello(VideoStreamControlMessage::HELLO, 0, outstanding);
+                hello.layers = mMaxLayers;
+                hello.maxFrameRate = mMaxFrameRate;
+                hello.flags = VideoStreamControlMessage::FLAG_KEYFRAME;
+                sendControl(socket, hello);
+                bool receiving = false;
+                uint32_t frameId = 0;
+
+                for (;;)
+                {
+                    VideoStreamFrameHeader header;
+                    read(socket, headerBuffer.data(), headerBuffer.size(), -1);
+                    if (!header.read(headerBuffer.data(), mMaxPayloadSize))
+                        throw std::runtime_error("Bad frame header");
+
+                    std::shared_ptr<VideoStreamFrame> frame = mFramePool ? mFramePool->createFrame(header) : VideoStreamFrame::create(header);
+                    read(socket, frame->getData(), frame->getSize(), frame->getBufferIndex());
+                    mFrameQueue->push(frame);
+                    mQueuedIds.push_back(header.frameId);
+                    receivedFrame();
+                    (*mStatus).assign("Streaming");
+
+                    // A credit pays for a whole frame. The server may have sent
+                    // frames before our HELLO reached it and counts them
+                    // against the window too, so this can hit zero early.
+                    if (!receiving || header.frameId != frameId){
+                        if (outstanding) outstanding--;
+                        receiving = true;
+                        frameId = header.frameId;
+                    }
+                    // Hand back credits only for what the app has consumed. With
+                    // nothing left in flight, wait for the queue to drain unless
+                    // more of the current frame is already on its way.
+                    uint32_t credits;
+                    while ((credits = grantableCredits(outstanding)) == 0 && outstanding == 0 && mRunning && socket.available() == 0)
+                        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                    if (credits){
+                        outstanding += credits;
+                        sendControl(socket, VideoStreamControlMessage(VideoStreamControlMessage::ACK, header.frameId, credits));
+                    }
+                }
+            }
+            catch (std::exception& e)
+            {
+                (*mStatus).assign(e.what(), strlen(e.what()));
+                startWaitingForFirstFrame();
+                backoff();
+            }
+        }
+    }
+
 //    boost::asio::io_service mIOService;
     asio::io_service mIOService;
     
     ph::ConcurrentQueue<T*>* mQueue;
+    ph::ConcurrentQueue<VideoStreamFrameRef>* mFrameQueue;
+    VideoStreamFramePoolRef mFramePool;
+    uint32_t mMaxPayloadSize;
+    uint32_t mCreditWindow;
+    uint16_t mMaxLayers;
+    uint16_t mMaxFrameRate;
+    std::atomic<bool> mRunning;
+    std::shared_ptr<tcp::socket> mSocket;
+    std::mutex mSocketMutex;
+    std::vector<tcp::endpoint> mEndpoints;
+    std::deque<uint32_t> mQueuedIds;
+    Clock::duration mBackoff;
+    Clock::time_point mConnectStart;
+    bool mWaitingForFirstFrame;
+    std::atomic<int64_t> mTimeToFirstFrame; // microseconds
+#ifdef CINDER_VIDEOSTREAM_IO_URING
+    std::unique_ptr<VideoStreamUringTransport> mUring;
+#endif
     std::string mService;
     std::string mHost;
     std::string* mStatus;
+    int mNumaNode;
+    bool mHugePages;
     std::size_t mDataSize;
+    std::shared_ptr<uint8_t> mDataMemory;
     T* mData;
 };
 
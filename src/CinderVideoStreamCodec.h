@@ -0,0 +1,272 @@
+/*
+ CinderVideoStreamCodec.h
+
+ Copyright (c) 2015 onewaytheater.us
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy of
+ this software and associated documentation files (the "Software"), to deal in
+ the Software without restriction, including without limitation the rights to
+ use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ of the Software, and to permit persons to whom the Software is furnished to do
+ so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ */
+
+#ifndef CinderVideoStreamCodec_CinderVideoStreamCodec_h
+#define CinderVideoStreamCodec_CinderVideoStreamCodec_h
+#include "cinder/Buffer.h"
+#include "cinder/DataSource.h"
+#include "cinder/DataTarget.h"
+#include "cinder/ImageIo.h"
+#include "cinder/Stream.h"
+#include "cinder/Surface.h"
+#include "cinder/ip/Resize.h"
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <vector>
+#include "CinderVideoStreamFrame.h"
+#include "CinderVideoStreamPlacement.h"
+
+// JPEG codec for the streaming classes. Each frame can be cut into horizontal
+// slices that are coded independently on a pool of worker threads: the server
+// publishes every slice as soon as it is encoded and the client decodes slices
+// as they arrive, so per-frame codec latency drops with the number of cores.
+// With more than one layer every frame is also sent progressively: first at
+// 1/2^(layers-1) resolution, then doubling until full size, and the decoder
+// hands out each layer as soon as it is complete.
+class CinderVideoStreamCodec{
+    public:
+
+    CinderVideoStreamCodec(std::size_t numSlices = 1, float quality = 0.5f, std::size_t numThreads = 0)
+                                :mNumSlices(std::max<std::size_t>(numSlices, 1)), mNumLayers(1), mQuality(quality), mHasDelivered(false), mLastDelivered(0, 0){
+        if (numThreads == 0) numThreads = std::min<std::size_t>(mNumSlices, std::max(1u, std::thread::hardware_concurrency()));
+        for (std::size_t i = 0; i < numThreads; i++)
+            mWorkers.push_back(std::shared_ptr<Worker>(new Worker()));
+    }
+    ~CinderVideoStreamCodec(){
+        for (auto& worker : mWorkers) worker->stop();
+    }
+
+    void setQuality(float quality) { mQuality = quality; }
+    float getQuality() const { return mQuality; }
+    std::size_t getNumSlices() const { return mNumSlices; }
+    void setNumLayers(std::size_t layers) { mNumLayers = std::max<std::size_t>(std::min<std::size_t>(layers, 8), 1); }
+    std::size_t getNumLayers() const { return mNumLayers; }
+    // Pins worker i to the i-th CPU of placement, e.g. the cores next to the
+    // capture thread so that surfaces are encoded from a warm cache.
+    void setPlacement(const VideoStreamStagePlacement& placement){
+        for (std::size_t i = 0; i < mWorkers.size(); i++)
+            placement.apply(mWorkers[i]->thread, i);
+    }
+    // Encoded slices are copied into slots of pool, e.g. the pool the sharded
+    // server registers with io_uring, instead of onto the heap.
+    void setFramePool(VideoStreamFramePoolRef pool) { mFramePool = pool; }
+
+    // Returns immediately; slices are pushed to queueToServer as they finish.
+    // Coarse layers are small and go out whole, queued ahead of the full
+    // resolution slices.
+    void encode(ci::Surface8uRef surface, uint32_t frameId, ph::ConcurrentQueue<VideoStreamFrameRef>* queueToServer){
+        uint16_t layers = (uint16_t)mNumLayers;
+        float quality = mQuality;
+        VideoStreamFramePoolRef pool = mFramePool;
+        std::size_t worker = 0;
+        for (uint16_t layer = 0; layer + 1 < layers; layer++){
+            int shift = layers - 1 - layer;
+            ci::ivec2 size(std::max(surface->getWidth() >> shift, 1), std::max(surface->getHeight() >> shift, 1));
+            VideoStreamFrameHeader info;
+            info.frameId = frameId;
+            info.frameHeight = (uint16_t)size.y;
+            info.layer = layer;
+            info.layerCount = layers;
+            mWorkers[worker++ % mWorkers.size()]->jobs.push([surface, size, info, quality, pool, queueToServer]{
+                ci::Surface8u coarse = ci::ip::resize(*surface, size);
+                encodeSlice(coarse, info, quality, pool, queueToServer);
+            });
+        }
+
+        int height = surface->getHeight();
+        int slices = (int)std::min<std::size_t>(mNumSlices, std::max(height, 1));
+        int sliceHeight = (height + slices - 1) / slices;
+        for (int i = 0; i < slices; i++){
+            VideoStreamFrameHeader info;
+            info.frameId = frameId;
+            info.sliceIndex = (uint16_t)i;
+            info.sliceCount = (uint16_t)slices;
+            info.sliceRow = (uint16_t)(i * sliceHeight);
+            info.frameHeight = (uint16_t)height;
+            info.layer = layers - 1;
+            info.layerCount = layers;
+            ci::Area area(0, i * sliceHeight, surface->getWidth(), std::min(height, (i + 1) * sliceHeight));
+            mWorkers[worker++ % mWorkers.size()]->jobs.push([surface, area, info, quality, pool, queueToServer]{
+                encodeSlice(surface->clone(area), info, quality, pool, queueToServer);
+            });
+        }
+    }
+
+    // Decodes one received slice on the worker pool. When every slice of a
+    // layer is in place the assembled surface is pushed to queueFromServer,
+    // unless a newer frame or a finer layer of this one was already pushed.
+    void decode(VideoStreamFrameRef slice, ph::ConcurrentQueue<ci::Surface8uRef>* queueFromServer){
+        const VideoStreamFrameHeader& info = slice->getInfo();
+        AssemblyKey key(info.frameId, info.layer);
+        std::shared_ptr<Assembly> assembly;
+        {
+            std::lock_guard<std::mutex> lock(mAssemblyMutex);
+            // Ids far behind what was seen start a new stream.
+            bool newStream = mHasDelivered && VideoStreamFrameHeader::isNewStream(info.frameId, mLastDelivered.first);
+            for (auto& pending : mAssemblies)
+                newStream = newStream || VideoStreamFrameHeader::isNewStream(info.frameId, pending->key.first);
+            if (newStream) clear();
+            if (isDelivered(key)) return;
+            auto it = findAssembly(key);
+            if (it != mAssemblies.end())
+                assembly = *it;
+            else {
+                if (mAssemblies.size() >= MAX_ASSEMBLIES && isBefore(key, (*oldestAssembly())->key))
+                    return;
+                assembly.reset(new Assembly());
+                assembly->key = key;
+                assembly->remaining = info.sliceCount;
+                mAssemblies.push_back(assembly);
+                if (mAssemblies.size() > MAX_ASSEMBLIES) mAssemblies.erase(oldestAssembly());
+            }
+        }
+        mWorkers[info.sliceIndex % mWorkers.size()]->jobs.push([this, slice, assembly, queueFromServer]{
+            const VideoStreamFrameHeader& info = slice->getInfo();
+            ci::BufferRef buffer = ci::Buffer::create(const_cast<uint8_t*>(slice->getData()), slice->getSize());
+            ci::Surface8u decoded;
+            try {
+                decoded = ci::Surface8u(ci::loadImage(ci::DataSourceBuffer::create(buffer), ci::ImageSource::Options(), "jpeg"), ci::SurfaceConstraintsDefault(), false);
+            }
+            catch (std::exception&) {
+                // A corrupt slice only loses its frame; the assembly ages out.
+                return;
+            }
+            {
+                std::lock_guard<std::mutex> lock(mAssemblyMutex);
+                if (!assembly->surface)
+                    assembly->surface = ci::Surface8u::create(decoded.getWidth(), info.frameHeight, false, ci::SurfaceChannelOrder::RGB);
+            }
+            // Slices cover disjoint rows, so workers may copy concurrently.
+            assembly->surface->copyFrom(decoded, decoded.getBounds(), ci::ivec2(0, info.sliceRow));
+            if (--assembly->remaining > 0) return;
+
+            std::lock_guard<std::mutex> lock(mAssemblyMutex);
+            AssemblyKey key(info.frameId, info.layer);
+            if (findAssembly(key) == mAssemblies.end() || isDelivered(key)) return;
+            // This and everything before it is done.
+            mAssemblies.erase(std::remove_if(mAssemblies.begin(), mAssemblies.end(), [&key](const std::shared_ptr<Assembly>& pending){
+                return !isBefore(key, pending->key);
+            }), mAssemblies.end());
+            mHasDelivered = true;
+            mLastDelivered = key;
+            queueFromServer->push(assembly->surface);
+        });
+    }
+
+    // Forgets every frame seen so far, e.g. when switching to another stream.
+    // A far jump back in frame ids, as after a server restart, is noticed by
+    // decode() without it.
+    void reset(){
+        std::lock_guard<std::mutex> lock(mAssemblyMutex);
+        clear();
+    }
+
+private:
+    static void encodeSlice(const ci::Surface8u& slice, const VideoStreamFrameHeader& info, float quality, VideoStreamFramePoolRef pool, ph::ConcurrentQueue<VideoStreamFrameRef>* queueToServer){
+        // Runs on a worker thread; an exception here must not take it down.
+        try {
+            ci::OStreamMemRef os = ci::OStreamMem::create();
+            ci::DataTargetRef target = ci::DataTargetStream::createRef( os );
+            ci::writeImage( target, slice, ci::ImageTarget::Options().quality(quality), "jpeg" );
+            queueToServer->push(pool ? pool->createFrame(os->getBuffer(), (size_t)os->tell(), info)
+                                     : VideoStreamFrame::create(os->getBuffer(), (size_t)os->tell(), info));
+        }
+        catch (std::exception&) {
+            // The frame goes out without this slice; clients skip to the next.
+        }
+    }
+
+    typedef std::pair<uint32_t, uint16_t> AssemblyKey; // frame id, layer
+    static const std::size_t MAX_ASSEMBLIES = 8;
+
+    struct Assembly{
+        AssemblyKey key;
+        ci::Surface8uRef surface;
+        std::atomic<int> remaining;
+    };
+    typedef std::vector<std::shared_ptr<Assembly> > Assemblies;
+
+    // Frame ids wrap, so keys are ordered by signed distance rather than
+    // by value. Assemblies always lie within a few frames of each other,
+    // where that order is consistent.
+    static bool isBefore(const AssemblyKey& a, const AssemblyKey& b){
+        if (a.first != b.first) return (int32_t)(a.first - b.first) < 0;
+        return a.second < b.second;
+    }
+
+    // The rest require mAssemblyMutex.
+    Assemblies::iterator findAssembly(const AssemblyKey& key){
+        return std::find_if(mAssemblies.begin(), mAssemblies.end(), [&key](const std::shared_ptr<Assembly>& pending){
+            return pending->key == key;
+        });
+    }
+    Assemblies::iterator oldestAssembly(){
+        return std::min_element(mAssemblies.begin(), mAssemblies.end(), [](const std::shared_ptr<Assembly>& a, const std::shared_ptr<Assembly>& b){
+            return isBefore(a->key, b->key);
+        });
+    }
+    bool isDelivered(const AssemblyKey& key) const{
+        if (!mHasDelivered) return false;
+        if (key.first == mLastDelivered.first) return key.second <= mLastDelivered.second;
+        return VideoStreamFrameHeader::isOlder(key.first, mLastDelivered.first);
+    }
+    void clear(){
+        mAssemblies.clear();
+        mHasDelivered = false;
+    }
+
+    struct Worker{
+        Worker(){
+            thread = std::thread([this]{
+                std::function<void()> job;
+                while (true){
+                    jobs.wait_and_pop(job);
+                    if (!job) break;
+                    job();
+                }
+            });
+        }
+        void stop(){
+            jobs.push(std::function<void()>());
+            if (thread.joinable()) thread.join();
+        }
+        ph::ConcurrentQueue<std::function<void()> > jobs;
+        std::thread thread;
+    };
+
+    std::vector<std::shared_ptr<Worker> > mWorkers;
+    VideoStreamFramePoolRef mFramePool;
+    Assemblies mAssemblies; // at most MAX_ASSEMBLIES, in arrival order
+    std::mutex mAssemblyMutex;
+    std::size_t mNumSlices;
+    std::size_t mNumLayers;
+    float mQuality;
+    bool mHasDelivered;
+    AssemblyKey mLastDelivered;
+};
+
+#endif
@@ -0,0 +1,287 @@
+/*
+ CinderVideoStreamFrame.h
+
+ Copyright (c) 2015 onewaytheater.us
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy of
+ this software and associated documentation files (the "Software"), to deal in
+ the Software without restriction, including without limitation the rights to
+ use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ of the Software, and to permit persons to whom the Software is furnished to do
+ so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ */
+
+#ifndef CinderVideoStreamFrame_CinderVideoStreamFrame_h
+#define CinderVideoStreamFrame_CinderVideoStreamFrame_h
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "CinderVideoStreamPlacement.h"
+
+// Wire header sent in front of every payload on a streaming connection.
+// All fields are big endian. A frame may be split into horizontal slices that
+// are coded independently; sliceRow and frameHeight place a slice in the image.
+// In progressive mode a frame is sent as layerCount layers of rising
+// resolution, layer 0 being the coarsest; slice fields are in layer pixels.
+struct VideoStreamFrameHeader{
+    static const uint32_t MAGIC = 0x43565333; // "CVS3"
+    static const std::size_t SIZE = 24;
+    // Default bound on payloadSize accepted by read(); above any raw 4K frame,
+    // so a corrupt header cannot make the reader allocate gigabytes.
+    static const uint32_t MAX_PAYLOAD_SIZE = 1 << 26;
+
+    uint32_t frameId;
+    uint32_t payloadSize;
+    uint16_t sliceIndex;
+    uint16_t sliceCount;
+    uint16_t sliceRow;
+    uint16_t frameHeight;
+    uint16_t layer;
+    uint16_t layerCount;
+
+    VideoStreamFrameHeader():frameId(0), payloadSize(0), sliceIndex(0), sliceCount(1), sliceRow(0), frameHeight(0), layer(0), layerCount(1){}
+
+    void write(uint8_t* out) const{
+        putUint32(out, MAGIC);
+        putUint32(out + 4, frameId);
+        putUint32(out + 8, payloadSize);
+        putUint16(out + 12, sliceIndex);
+        putUint16(out + 14, sliceCount);
+        putUint16(out + 16, sliceRow);
+        putUint16(out + 18, frameHeight);
+        putUint16(out + 20, layer);
+        putUint16(out + 22, layerCount);
+    }
+    bool read(const uint8_t* in, uint32_t maxPayloadSize = MAX_PAYLOAD_SIZE){
+        if (getUint32(in) != MAGIC) return false;
+        frameId = getUint32(in + 4);
+        payloadSize = getUint32(in + 8);
+        sliceIndex = getUint16(in + 12);
+        sliceCount = getUint16(in + 14);
+        sliceRow = getUint16(in + 16);
+        frameHeight = getUint16(in + 18);
+        layer = getUint16(in + 20);
+        layerCount = getUint16(in + 22);
+        return payloadSize <= maxPayloadSize && sliceCount > 0 && sliceIndex < sliceCount && layer < layerCount;
+    }
+
+    // Frame ids wrap, so order them by signed distance. An id more than
+    // REORDER_WINDOW behind is not late but the start of a new stream, as
+    // after a publisher restart.
+    static const int32_t REORDER_WINDOW = 64;
+    static bool isOlder(uint32_t frameId, uint32_t newest){
+        int32_t behind = (int32_t)(newest - frameId);
+        return behind > 0 && behind <= REORDER_WINDOW;
+    }
+    static bool isNewStream(uint32_t frameId, uint32_t newest){
+        return (int32_t)(newest - frameId) > REORDER_WINDOW;
+    }
+
+    static void putUint16(uint8_t* out, uint16_t v){
+        out[0] = (uint8_t)(v >> 8);
+        out[1] = (uint8_t)v;
+    }
+    static uint16_t getUint16(const uint8_t* in){
+        return (uint16_t)((in[0] << 8) | in[1]);
+    }
+    static void putUint32(uint8_t* out, uint32_t v){
+        out[0] = (uint8_t)(v >> 24);
+        out[1] = (uint8_t)(v >> 16);
+        out[2] = (uint8_t)(v >> 8);
+        out[3] = (uint8_t)v;
+    }
+    static uint32_t getUint32(const uint8_t* in){
+        return ((uint32_t)in[0] << 24) | ((uint32_t)in[1] << 16) | ((uint32_t)in[2] << 8) | (uint32_t)in[3];
+    }
+};
+
+// Message sent by a streaming client back to the server on the same
+// connection. HELLO opens flow control with an initial credit window; ACK
+// acknowledges frameId and grants further credits. The server spends one
+// credit on the first message of each frame; its other slices and layers
+// follow under it. It never starts a frame without credit, so at most the
+// window of frames is in flight at any time. A HELLO with non-zero layers
+// subscribes to the first that many progressive layers, and a non-zero
+// maxFrameRate asks the server to send at most that many frames per second,
+// always the newest. FLAG_KEYFRAME asks for the server's latest frame right
+// away instead of waiting for the next one.
+struct VideoStreamControlMessage{
+    static const uint32_t MAGIC = 0x43565344; // "CVSD"
+    static const std::size_t SIZE = 20;
+    enum Type { HELLO = 1, ACK = 2 };
+    enum Flags { FLAG_KEYFRAME = 1 };
+
+    uint16_t type;
+    uint16_t layers;
+    uint32_t frameId;
+    uint32_t credits;
+    uint16_t maxFrameRate;
+    uint16_t flags;
+
+    VideoStreamControlMessage(uint16_t type = ACK, uint32_t frameId = 0, uint32_t credits = 0)
+                                :type(type), layers(0), frameId(frameId), credits(credits), maxFrameRate(0), flags(0){}
+
+    void write(uint8_t* out) const{
+        VideoStreamFrameHeader::putUint32(out, MAGIC);
+        VideoStreamFrameHeader::putUint16(out + 4, type);
+        VideoStreamFrameHeader::putUint16(out + 6, layers);
+        VideoStreamFrameHeader::putUint32(out + 8, frameId);
+        VideoStreamFrameHeader::putUint32(out + 12, credits);
+        VideoStreamFrameHeader::putUint16(out + 16, maxFrameRate);
+        VideoStreamFrameHeader::putUint16(out + 18, flags);
+    }
+    bool read(const uint8_t* in){
+        if (VideoStreamFrameHeader::getUint32(in) != MAGIC) return false;
+        type = VideoStreamFrameHeader::getUint16(in + 4);
+        layers = VideoStreamFrameHeader::getUint16(in + 6);
+        frameId = VideoStreamFrameHeader::getUint32(in + 8);
+        credits = VideoStreamFrameHeader::getUint32(in + 12);
+        maxFrameRate = VideoStreamFrameHeader::getUint16(in + 16);
+        flags = VideoStreamFrameHeader::getUint16(in + 18);
+        return type == HELLO || type == ACK;
+    }
+};
+
+class VideoStreamFrame;
+class VideoStreamFramePool;
+typedef std::shared_ptr<const VideoStreamFrame> VideoStreamFrameRef;
+typedef std::shared_ptr<VideoStreamFramePool> VideoStreamFramePoolRef;
+
+// An encoded frame together with its serialized header. Once handed out as a
+// VideoStreamFrameRef it is immutable, so any number of sockets may send it
+// concurrently without copying. Header and payload are stored back to back so
+// the whole frame goes out as a single buffer.
+class VideoStreamFrame{
+    public:
+
+    // Allocates an empty payload to be filled before the frame is published.
+    static std::shared_ptr<VideoStreamFrame> create(const VideoStreamFrameHeader& info){
+        std::shared_ptr<VideoStreamFrame> frame(new VideoStreamFrame(info));
+        frame->mHeapStorage.resize(VideoStreamFrameHeader::SIZE + info.payloadSize);
+        frame->setStorage(frame->mHeapStorage.data(), -1);
+        return frame;
+    }
+    static std::shared_ptr<VideoStreamFrame> create(std::size_t size, uint32_t frameId){
+        VideoStreamFrameHeader info;
+        info.frameId = frameId;
+        info.payloadSize = (uint32_t)size;
+        return create(info);
+    }
+    static VideoStreamFrameRef create(const void* data, std::size_t size, VideoStreamFrameHeader info){
+        info.payloadSize = (uint32_t)size;
+        std::shared_ptr<VideoStreamFrame> frame = create(info);
+        if (size) memcpy(frame->getData(), data, size);
+        return frame;
+    }
+    static VideoStreamFrameRef create(const void* data, std::size_t size, uint32_t frameId){
+        VideoStreamFrameHeader info;
+        info.frameId = frameId;
+        return create(data, size, info);
+    }
+    ~VideoStreamFrame(){
+        if (mRelease) mRelease();
+    }
+
+    const VideoStreamFrameHeader& getInfo() const { return mInfo; }
+    uint32_t getFrameId() const { return mInfo.frameId; }
+    std::size_t getSize() const { return mInfo.payloadSize; }
+    const uint8_t* getData() const { return mWire + VideoStreamFrameHeader::SIZE; }
+    uint8_t* getData() { return mWire + VideoStreamFrameHeader::SIZE; }
+
+    // Header followed by payload, exactly as sent on the wire.
+    const uint8_t* getWireData() const { return mWire; }
+    std::size_t getWireSize() const { return VideoStreamFrameHeader::SIZE + mInfo.payloadSize; }
+    // Index of the frame's slot in its VideoStreamFramePool, or -1 for heap frames.
+    int getBufferIndex() const { return mBufferIndex; }
+
+private:
+    friend class VideoStreamFramePool;
+
+    VideoStreamFrame(const VideoStreamFrameHeader& info):mWire(nullptr), mBufferIndex(-1), mInfo(info){}
+    void setStorage(uint8_t* wire, int bufferIndex){
+        mWire = wire;
+        mBufferIndex = bufferIndex;
+        mInfo.write(mWire);
+    }
+
+    uint8_t* mWire;
+    int mBufferIndex;
+    std::vector<uint8_t> mHeapStorage;
+    std::function<void()> mRelease;
+    VideoStreamFrameHeader mInfo;
+};
+
+// Fixed set of equally sized frame slots carved out of one allocation. The
+// memory never moves, so transports can register it with the kernel once.
+// Frames that do not fit, or arrive while every slot is taken, fall back to
+// the heap. The slots can be placed on the NUMA node of the stage that fills
+// them and backed by huge pages, see VideoStreamMemory.
+class VideoStreamFramePool : public std::enable_shared_from_this<VideoStreamFramePool>{
+    public:
+
+    static VideoStreamFramePoolRef create(std::size_t maxPayloadSize, std::size_t numSlots, int numaNode = -1, bool hugePages = false){
+        return VideoStreamFramePoolRef(new VideoStreamFramePool(maxPayloadSize, numSlots, numaNode, hugePages));
+    }
+
+    std::shared_ptr<VideoStreamFrame> createFrame(const VideoStreamFrameHeader& info){
+        if (VideoStreamFrameHeader::SIZE + info.payloadSize <= mSlotSize){
+            std::unique_lock<std::mutex> lock(mMutex);
+            if (!mFreeSlots.empty()){
+                int slot = mFreeSlots.back();
+                mFreeSlots.pop_back();
+                lock.unlock();
+
+                std::shared_ptr<VideoStreamFrame> frame(new VideoStreamFrame(info));
+                frame->setStorage(getSlot(slot), slot);
+                VideoStreamFramePoolRef pool = shared_from_this();
+                frame->mRelease = [pool, slot]{ pool->release(slot); };
+                return frame;
+            }
+        }
+        return VideoStreamFrame::create(info);
+    }
+    VideoStreamFrameRef createFrame(const void* data, std::size_t size, VideoStreamFrameHeader info){
+        info.payloadSize = (uint32_t)size;
+        std::shared_ptr<VideoStreamFrame> frame = createFrame(info);
+        if (size) memcpy(frame->getData(), data, size);
+        return frame;
+    }
+
+    std::size_t getNumSlots() const { return mNumSlots; }
+    std::size_t getSlotSize() const { return mSlotSize; }
+    uint8_t* getSlot(int slot) { return mMemory.get() + slot * mSlotSize; }
+
+private:
+    VideoStreamFramePool(std::size_t maxPayloadSize, std::size_t numSlots, int numaNode, bool hugePages)
+                                :mSlotSize(VideoStreamFrameHeader::SIZE + maxPayloadSize), mNumSlots(numSlots),
+                                 mMemory(VideoStreamMemory::allocate(mSlotSize * numSlots, numaNode, hugePages)){
+        for (std::size_t i = numSlots; i > 0; i--) mFreeSlots.push_back((int)(i - 1));
+    }
+    void release(int slot){
+        std::lock_guard<std::mutex> lock(mMutex);
+        mFreeSlots.push_back(slot);
+    }
+
+    std::size_t mSlotSize;
+    std::size_t mNumSlots;
+    std::shared_ptr<uint8_t> mMemory;
+    std::vector<int> mFreeSlots;
+    std::mutex mMutex;
+};
+
+#endif
@@ -0,0 +1,227 @@
+/*
+ CinderVideoStreamImpairmentProxy.h
+
+ Copyright (c) 2015 onewaytheater.us
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy of
+ this software and associated documentation files (the "Software"), to deal in
+ the Software without restriction, including without limitation the rights to
+ use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ of the Software, and to permit persons to whom the Software is furnished to do
+ so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ */
+
+#ifndef CinderVideoStreamImpairmentProxy_CinderVideoStreamImpairmentProxy_h
+#define CinderVideoStreamImpairmentProxy_CinderVideoStreamImpairmentProxy_h
+#include "asio/asio.hpp"
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <vector>
+
+// Network conditions applied by CinderVideoStreamImpairmentProxy to each
+// direction of a connection. Zero means "not impaired".
+struct VideoStreamImpairment{
+    VideoStreamImpairment():bytesPerSecond(0), delay(0), jitter(0), lossRate(0), retransmitDelay(0.2),
+                            reorderRate(0), reorderDelay(0.01), packetSize(1448), queueBytes(1 << 22), seed(1){}
+
+    double bytesPerSecond;      // bottleneck bandwidth
+    double delay;               // one way delay, seconds
+    double jitter;              // delay varies uniformly by +/- jitter
+    double lossRate;            // probability a packet needs a retransmission
+    double retransmitDelay;     // what one retransmission costs
+    double reorderRate;         // probability a packet arrives late
+    double reorderDelay;        // how late it arrives
+    std::size_t packetSize;
+    std::size_t queueBytes;     // bottleneck buffer; reading stops when full
+    unsigned seed;              // same seed, same impairment sequence
+};
+
+// TCP proxy that sits between a streaming client and server on one machine
+// and degrades the link in between. Both sides still speak TCP to the proxy,
+// so loss and reordering show up the way they do on a real TCP path: a lost
+// packet arrives one retransmission later and a reordered one arrives late,
+// and in both cases everything behind it waits (head-of-line blocking).
+class CinderVideoStreamImpairmentProxy{
+    public:
+
+    CinderVideoStreamImpairmentProxy(unsigned short port, std::string upstreamHost, std::string upstreamService, const VideoStreamImpairment& impairment = VideoStreamImpairment())
+                                :mAcceptor(mIOService, asio::ip::tcp::endpoint(asio::ip::tcp::v4(), port), true),
+                                 mUpstreamHost(upstreamHost), mUpstreamService(upstreamService), mImpairment(impairment), mRandom(impairment.seed){
+    }
+    ~CinderVideoStreamImpairmentProxy(){
+        stop();
+    }
+
+    // Blocks the calling thread proxying connections until stop() is called.
+    void run(){
+        startAccept();
+        mIOService.run();
+    }
+    void stop(){
+        mIOService.stop();
+    }
+    // Applies to connections accepted from now on.
+    void setImpairment(const VideoStreamImpairment& impairment){
+        std::lock_guard<std::mutex> lock(mMutex);
+        mImpairment = impairment;
+    }
+
+private:
+    typedef std::chrono::steady_clock Clock;
+    typedef std::shared_ptr<asio::ip::tcp::socket> SocketRef;
+
+    // Carries one direction of a connection, releasing every packet at the
+    // time the simulated link would have delivered it.
+    class Pipe : public std::enable_shared_from_this<Pipe>{
+        public:
+        Pipe(asio::io_service& ioService, SocketRef from, SocketRef to, const VideoStreamImpairment& impairment, unsigned seed)
+                                :mTimer(ioService), mFrom(from), mTo(to), mImpairment(impairment), mRandom(seed),
+                                 mReadBuffer(1 << 16), mQueuedBytes(0), mReading(false), mWriting(false),
+                                 mLinkFree(Clock::now()), mLastDelivery(Clock::now()){
+        }
+        void start(){
+            read();
+        }
+
+    private:
+        struct Packet{
+            Clock::time_point due;
+            std::vector<uint8_t> data;
+        };
+
+        void read(){
+            if (mReading || mQueuedBytes >= mImpairment.queueBytes) return;
+            mReading = true;
+            std::shared_ptr<Pipe> self = shared_from_this();
+            mFrom->async_read_some(asio::buffer(mReadBuffer), [self](const asio::error_code& error, std::size_t bytes){
+                self->mReading = false;
+                if (error){
+                    self->close();
+                    return;
+                }
+                self->schedule(bytes);
+                self->read();
+            });
+        }
+        void schedule(std::size_t bytes){
+            std::uniform_real_distribution<double> uniform(0.0, 1.0);
+            Clock::time_point now = Clock::now();
+            for (std::size_t offset = 0; offset < bytes; offset += mImpairment.packetSize){
+                std::size_t size = std::min(mImpairment.packetSize, bytes - offset);
+                Packet packet;
+                packet.data.assign(mReadBuffer.begin() + offset, mReadBuffer.begin() + offset + size);
+
+                mLinkFree = std::max(mLinkFree, now);
+                if (mImpairment.bytesPerSecond > 0)
+                    mLinkFree += toDuration(size / mImpairment.bytesPerSecond);
+                double latency = mImpairment.delay + mImpairment.jitter * (2.0 * uniform(mRandom) - 1.0);
+                if (uniform(mRandom) < mImpairment.lossRate) latency += mImpairment.retransmitDelay;
+                if (uniform(mRandom) < mImpairment.reorderRate) latency += mImpairment.reorderDelay;
+                // TCP hands data over in order, so nothing overtakes a late packet.
+                packet.due = std::max(mLinkFree + toDuration(std::max(latency, 0.0)), mLastDelivery);
+                mLastDelivery = packet.due;
+
+                mQueuedBytes += size;
+                mPackets.push_back(std::move(packet));
+            }
+            write();
+        }
+        void write(){
+            if (mWriting || mPackets.empty()) return;
+            std::shared_ptr<Pipe> self = shared_from_this();
+            if (mPackets.front().due > Clock::now()){
+                mTimer.expires_at(mPackets.front().due);
+                mTimer.async_wait([self](const asio::error_code& error){
+                    if (!error) self->write();
+                });
+                return;
+            }
+            mWriting = true;
+            asio::async_write(*mTo, asio::buffer(mPackets.front().data), [self](const asio::error_code& error, std::size_t bytes){
+                self->mWriting = false;
+                if (error){
+                    self->close();
+                    return;
+                }
+                self->mQueuedBytes -= bytes;
+                self->mPackets.pop_front();
+                self->write();
+                self->read();
+            });
+        }
+        void close(){
+            asio::error_code e;
+            mTimer.cancel(e);
+            mFrom->close(e);
+            mTo->close(e);
+        }
+        static Clock::duration toDuration(double seconds){
+            return std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(seconds));
+        }
+
+        asio::steady_timer mTimer;
+        SocketRef mFrom;
+        SocketRef mTo;
+        VideoStreamImpairment mImpairment;
+        std::mt19937 mRandom;
+        std::vector<uint8_t> mReadBuffer;
+        std::deque<Packet> mPackets;
+        std::size_t mQueuedBytes;
+        bool mReading;
+        bool mWriting;
+        Clock::time_point mLinkFree;
+        Clock::time_point mLastDelivery;
+    };
+
+    void startAccept(){
+        SocketRef downstream(new asio::ip::tcp::socket(mIOService));
+        mAcceptor.async_accept(*downstream, [this, downstream](const asio::error_code& error){
+            if (!error) connect(downstream);
+            if (mAcceptor.is_open()) startAccept();
+        });
+    }
+    void connect(SocketRef downstream){
+        asio::ip::tcp::resolver resolver(mIOService);
+        asio::ip::tcp::resolver::query query(asio::ip::tcp::v4(), mUpstreamHost, mUpstreamService);
+        SocketRef upstream(new asio::ip::tcp::socket(mIOService));
+        asio::error_code error;
+        asio::connect(*upstream, resolver.resolve(query, error), error);
+        if (error){
+            downstream->close(error);
+            return;
+        }
+        asio::ip::tcp::no_delay noDelay(true);
+        upstream->set_option(noDelay, error);
+        downstream->set_option(noDelay, error);
+
+        std::lock_guard<std::mutex> lock(mMutex);
+        std::shared_ptr<Pipe>(new Pipe(mIOService, upstream, downstream, mImpairment, mRandom()))->start();
+        std::shared_ptr<Pipe>(new Pipe(mIOService, downstream, upstream, mImpairment, mRandom()))->start();
+    }
+
+    asio::io_service mIOService;
+    asio::ip::tcp::acceptor mAcceptor;
+    std::string mUpstreamHost;
+    std::string mUpstreamService;
+    VideoStreamImpairment mImpairment;
+    std::mt19937 mRandom;
+    std::mutex mMutex;
+};
+
+#endif
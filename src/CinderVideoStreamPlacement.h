@@ -0,0 +1,163 @@
+/*
+ CinderVideoStreamPlacement.h
+
+ Copyright (c) 2015 onewaytheater.us
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy of
+ this software and associated documentation files (the "Software"), to deal in
+ the Software without restriction, including without limitation the rights to
+ use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ of the Software, and to permit persons to whom the Software is furnished to do
+ so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ */
+
+#ifndef CinderVideoStreamPlacement_CinderVideoStreamPlacement_h
+#define CinderVideoStreamPlacement_CinderVideoStreamPlacement_h
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/mman.h>
+#if defined(__linux__)
+#include <linux/mempolicy.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#elif defined(__APPLE__)
+#include <mach/mach.h>
+#include <mach/thread_policy.h>
+#include <pthread.h>
+#endif
+
+// Where one pipeline stage (capture, encode, network, render) runs and where
+// its buffers live. An empty CPU list and node -1 leave both to the OS.
+struct VideoStreamStagePlacement{
+    VideoStreamStagePlacement():numaNode(-1){}
+
+    std::vector<int> cpus;
+    int numaNode;
+
+    // Every CPU of a NUMA node, with buffers on that node. Without NUMA
+    // information (or on macOS) the CPU list stays empty.
+    static VideoStreamStagePlacement onNode(int node){
+        VideoStreamStagePlacement placement;
+        placement.numaNode = node;
+#if defined(__linux__)
+        std::ifstream cpulist("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+        std::string ranges;
+        std::getline(cpulist, ranges);
+        std::stringstream stream(ranges);
+        std::string range;
+        while (std::getline(stream, range, ',')){
+            if (range.empty()) continue;
+            std::size_t dash = range.find('-');
+            int first = std::stoi(range.substr(0, dash));
+            int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+            for (int cpu = first; cpu <= last; cpu++) placement.cpus.push_back(cpu);
+        }
+#endif
+        return placement;
+    }
+
+    // Lets the thread run on any CPU of the stage.
+    void apply(std::thread& thread) const{
+        if (!cpus.empty()) pin(thread.native_handle(), cpus);
+    }
+    void applyToCurrentThread() const{
+        if (!cpus.empty()) pin(pthread_self(), cpus);
+    }
+    // Pins the index-th thread of a stage to a single CPU of it, or to CPU
+    // index when the stage has no CPU list.
+    void apply(std::thread& thread, std::size_t index) const{
+        int cpu = cpus.empty() ? (int)(index % std::max(1u, std::thread::hardware_concurrency())) : cpus[index % cpus.size()];
+        pin(thread.native_handle(), std::vector<int>(1, cpu));
+    }
+
+    static void pin(pthread_t thread, const std::vector<int>& cpus){
+#if defined(__linux__)
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (int cpu : cpus) CPU_SET(cpu, &set);
+        pthread_setaffinity_np(thread, sizeof(set), &set);
+#elif defined(__APPLE__)
+        // macOS has no hard affinity; threads sharing a tag are kept together,
+        // distinct tags apart.
+        thread_affinity_policy_data_t policy = { cpus.front() + 1 };
+        thread_policy_set(pthread_mach_thread_np(thread), THREAD_AFFINITY_POLICY, (thread_policy_t)&policy, THREAD_AFFINITY_POLICY_COUNT);
+#endif
+    }
+};
+
+// Thread and memory placement for the whole pipeline.
+struct VideoStreamPlacement{
+    VideoStreamPlacement():hugePages(false){}
+
+    VideoStreamStagePlacement capture;
+    VideoStreamStagePlacement encode;
+    VideoStreamStagePlacement network;
+    VideoStreamStagePlacement render;
+    bool hugePages;     // back large frame buffers with huge pages
+
+    // Keeps every stage and its buffers on one socket.
+    static VideoStreamPlacement onNode(int node){
+        VideoStreamPlacement placement;
+        placement.capture = placement.encode = placement.network = placement.render = VideoStreamStagePlacement::onNode(node);
+        placement.hugePages = true;
+        return placement;
+    }
+};
+
+// Page-backed buffers for frame memory. With hugePages the allocation is
+// rounded up to 2MB pages (explicit hugetlb pages if reserved, transparent
+// huge pages otherwise); with a NUMA node it is bound to that node before
+// first touch. Falls back to ordinary pages wherever either is unavailable.
+class VideoStreamMemory{
+    public:
+
+    static std::shared_ptr<uint8_t> allocate(std::size_t size, int numaNode = -1, bool hugePages = false){
+        const std::size_t hugePageSize = 2 << 20;
+        std::size_t length = std::max<std::size_t>(size, 1);
+        void* memory = MAP_FAILED;
+#if defined(__linux__)
+        if (hugePages){
+            length = (length + hugePageSize - 1) / hugePageSize * hugePageSize;
+            memory = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        }
+#endif
+        if (memory == MAP_FAILED){
+            memory = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (memory == MAP_FAILED) throw std::bad_alloc();
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+            if (hugePages) madvise(memory, length, MADV_HUGEPAGE);
+#endif
+        }
+#if defined(__linux__)
+        if (numaNode >= 0 && numaNode < 64){
+            unsigned long nodemask = 1ul << numaNode;
+            syscall(SYS_mbind, memory, length, MPOL_PREFERRED, &nodemask, 64, 0);
+        }
+#endif
+        // Fault the pages in now rather than on the first frame.
+        memset(memory, 0, length);
+        return std::shared_ptr<uint8_t>((uint8_t*)memory, [length](uint8_t* p){ munmap(p, length); });
+    }
+};
+
+#endif
@@ -0,0 +1,73 @@
+/*
+ CinderVideoStreamRelay.h
+
+ Copyright (c) 2015 onewaytheater.us
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy of
+ this software and associated documentation files (the "Software"), to deal in
+ the Software without restriction, including without limitation the rights to
+ use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ of the Software, and to permit persons to whom the Software is furnished to do
+ so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ */
+
+#ifndef CinderVideoStreamRelay_CinderVideoStreamRelay_h
+#define CinderVideoStreamRelay_CinderVideoStreamRelay_h
+#include <memory>
+#include <string>
+#include <thread>
+#include "CinderVideoStreamClient.h"
+#include "CinderVideoStreamShardedServer.h"
+
+// Subscribes to an upstream server and republishes its frames to local
+// subscribers. Frames are never decoded: the buffer the upstream connection
+// reads into is the same one every downstream socket writes from, so relays
+// can be chained into distribution trees.
+class CinderVideoStreamRelay{
+    public:
+
+    CinderVideoStreamRelay(std::string upstreamHost, std::string upstreamService, unsigned short port, std::size_t numShards = 0)
+                                :mQueue(new ph::ConcurrentQueue<VideoStreamFrameRef>()),
+                                 mUpstream(new CinderVideoStreamClient<uint8_t>(upstreamHost, upstreamService)),
+                                 mServer(port, mQueue.get(), numShards){
+    }
+    ~CinderVideoStreamRelay(){
+        stop();
+    }
+    void setup(std::string* status){
+        mUpstream->setup(mQueue.get(), status);
+    }
+    // Blocks the calling thread serving downstream subscribers until stop().
+    void run(){
+        mUpstreamThread = std::thread([this]{ mUpstream->run(); });
+        mServer.run();
+    }
+    // Disconnects from upstream as well, so nothing touches status afterwards.
+    void stop(){
+        mUpstream->stop();
+        if (mUpstreamThread.joinable()) mUpstreamThread.join();
+        mServer.stop();
+    }
+
+    std::size_t getSubscriberCount() const { return mServer.getSubscriberCount(); }
+    uint64_t getBytesSent() const { return mServer.getBytesSent(); }
+
+private:
+    std::shared_ptr<ph::ConcurrentQueue<VideoStreamFrameRef> > mQueue;
+    std::shared_ptr<CinderVideoStreamClient<uint8_t> > mUpstream;
+    std::thread mUpstreamThread;
+    CinderVideoStreamShardedServer mServer;
+};
+
+#endif
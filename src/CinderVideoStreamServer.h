@@ -44,19 +44,20 @@ class CinderVideoStreamServer{
     void run(){
 
         T* data;
+        T* newer;
         boost::system::error_code ignored_error;
 
         while(true){
-            if (mQueue->try_pop(data)){
-                const mutable_buffer image_buffer(data, dSize);
-                mAcceptor.accept(mSocket);
+            mAcceptor.accept(mSocket);
+            // Frames queued while waiting for the client are stale; send the newest only.
+            mQueue->wait_and_pop(data);
+            while (mQueue->try_pop(newer)) data = newer;
 //                asio::write(mSocket, buffer(image_buffer), transfer_all(), ignored_error);
-                
-                asio::error_code e;
-                asio::write(mSocket, buffer(data, dSize), e);
-                
-                mSocket.close();
-            }
+
+            asio::error_code e;
+            asio::write(mSocket, buffer(data, dSize), e);
+
+            mSocket.close();
         }
     }
 private:
@@ -0,0 +1,366 @@
+/*
+ CinderVideoStreamShardedServer.h
+
+ Copyright (c) 2015 onewaytheater.us
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy of
+ this software and associated documentation files (the "Software"), to deal in
+ the Software without restriction, including without limitation the rights to
+ use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ of the Software, and to permit persons to whom the Software is furnished to do
+ so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ */
+
+#ifndef CinderVideoStreamShardedServer_CinderVideoStreamShardedServer_h
+#define CinderVideoStreamShardedServer_CinderVideoStreamShardedServer_h
+#include "asio/asio.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <vector>
+#include "CinderVideoStreamFrame.h"
+#include "CinderVideoStreamPlacement.h"
+#include "CinderVideoStreamUringTransport.h"
+
+// Streaming server for large fan-out. Subscribers keep one connection open and
+// are spread round-robin over a number of shards, each running its own
+// io_service on a thread pinned to one core (by default core i for shard i,
+// or the CPUs of a VideoStreamStagePlacement). Every published frame is shared
+// by reference between all shards; a subscriber that is still busy with an
+// older frame only keeps the slices of the newest frame pending. Nothing is
+// sent to a new subscriber until its HELLO arrives, or until HELLO_GRACE_MS
+// has passed for plain TCP readers that never send one. Clients that open flow
+// control with a VideoStreamControlMessage are only sent frames they have
+// credit for and only the progressive layers they asked for; the frames in
+// between are skipped in favour of the newest. A client that declares a maximum
+// frame rate is sent the newest frame on an even schedule at that rate, so
+// slow consumers cost proportionally less. Each shard remembers the latest
+// frame so that a (re)joining client can be sent it immediately. Built with
+// CINDER_VIDEOSTREAM_USE_IO_URING on Linux, shards send through io_uring and
+// submit one frame to all of their subscribers at once.
+class CinderVideoStreamShardedServer{
+    public:
+
+    CinderVideoStreamShardedServer(unsigned short port, ph::ConcurrentQueue<VideoStreamFrameRef>* queueToServer, std::size_t numShards = 0)
+                                :mAcceptor(mIOService, asio::ip::tcp::endpoint(asio::ip::tcp::v4(), port), true), mQueue(queueToServer),
+                                 mNextShard(0), mRunning(false), mBytesSent(0), mFramesSent(0), mSubscriberCount(0){
+        if (numShards == 0) numShards = std::max(1u, std::thread::hardware_concurrency());
+        for (std::size_t i = 0; i < numShards; i++)
+            mShards.push_back(std::shared_ptr<Shard>(new Shard(*this, i)));
+    }
+    ~CinderVideoStreamShardedServer(){
+        stop();
+    }
+
+    // Blocks the calling thread accepting subscribers until stop() is called.
+    void run(){
+        mRunning = true;
+        for (auto& shard : mShards) shard->start();
+        mDistributionThread = std::thread(std::bind(&CinderVideoStreamShardedServer::distributionLoop, this));
+        mPlacement.apply(mDistributionThread);
+        startAccept();
+        mIOService.run();
+    }
+    void stop(){
+        if (!mRunning.exchange(false)) return;
+        mIOService.stop();
+        mQueue->push(VideoStreamFrameRef());
+        if (mDistributionThread.joinable()) mDistributionThread.join();
+        for (auto& shard : mShards) shard->stop();
+    }
+
+    // Frames allocated from this pool are sent from registered buffers by the
+    // io_uring backend. Must be set before run().
+    void setFramePool(VideoStreamFramePoolRef pool) { mFramePool = pool; }
+    // Shard i runs on the i-th CPU of placement, the distribution thread on
+    // any of them. Must be set before run().
+    void setPlacement(const VideoStreamStagePlacement& placement) { mPlacement = placement; }
+
+    std::size_t getNumShards() const { return mShards.size(); }
+    std::size_t getSubscriberCount() const { return mSubscriberCount; }
+    uint64_t getBytesSent() const { return mBytesSent; }
+    uint64_t getFramesSent() const { return mFramesSent; }
+
+    // How long a new subscriber is given to open flow control before it is
+    // sent frames without it.
+    enum { HELLO_GRACE_MS = 250 };
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    struct Subscriber{
+        Subscriber(asio::io_service& ioService):socket(ioService), flowControl(false), credits(0), sentBeforeHello(0), maxLayers(0),
+                                                frameInterval(Clock::duration::zero()), lastFrameId(~0u), timer(ioService), timerArmed(false){}
+        asio::ip::tcp::socket socket;
+        VideoStreamFrameRef sending;
+        std::deque<VideoStreamFrameRef> pending;
+        bool flowControl;   // false until the client says HELLO; then credits apply
+        uint32_t credits;
+        uint32_t sentBeforeHello; // frames already taken out of the window the HELLO grants
+        uint16_t maxLayers; // progressive layers wanted, 0 for all
+        Clock::duration frameInterval; // zero when the client takes every frame
+        Clock::time_point nextFrameDue;
+        Clock::time_point helloDeadline;
+        uint32_t lastFrameId;
+        asio::steady_timer timer;
+        bool timerArmed;
+        std::array<uint8_t, VideoStreamControlMessage::SIZE> control;
+    };
+    typedef std::shared_ptr<Subscriber> SubscriberRef;
+
+    class Shard{
+        public:
+        Shard(CinderVideoStreamShardedServer& server, std::size_t index):mServer(server), mIndex(index), mBatching(false){}
+
+        void start(){
+            mWork.reset(new asio::io_service::work(mIOService));
+#ifdef CINDER_VIDEOSTREAM_IO_URING
+            try {
+                mUring.reset(new VideoStreamUringTransport(mServer.mFramePool));
+                mUringEvents.reset(new asio::posix::stream_descriptor(mIOService, dup(mUring->getEventFd())));
+                waitForCompletions();
+            }
+            catch (std::exception&) {
+                mUringEvents.reset();
+                mUring.reset();
+            }
+#endif
+            mThread = std::thread([this]{ mIOService.run(); });
+            mServer.mPlacement.apply(mThread, mIndex);
+        }
+        void stop(){
+            mWork.reset();
+            mIOService.stop();
+            if (mThread.joinable()) mThread.join();
+        }
+        asio::io_service& getIOService() { return mIOService; }
+
+        void add(SubscriberRef subscriber){
+            mIOService.post([this, subscriber]{
+                subscriber->helloDeadline = Clock::now() + std::chrono::milliseconds(HELLO_GRACE_MS);
+                mSubscribers.push_back(subscriber);
+                mServer.mSubscriberCount++;
+                receive(subscriber);
+            });
+        }
+        void publish(VideoStreamFrameRef frame){
+            mIOService.post([this, frame]{
+                uint32_t frameId = frame->getFrameId();
+                // Codec workers can finish a slice of the previous frame after
+                // the first slice of the next one; it is no use any more.
+                if (!mLatest.empty()){
+                    uint32_t latest = mLatest.back()->getFrameId();
+                    if (VideoStreamFrameHeader::isOlder(frameId, latest)) return;
+                    if (frameId != latest) mLatest.clear();
+                }
+                mLatest.push_back(frame);
+                mBatching = true;
+                for (auto& subscriber : mSubscribers){
+                    if (subscriber->maxLayers && frame->getInfo().layer >= subscriber->maxLayers) continue;
+                    // Slices of a newer frame replace whatever is still queued.
+                    if (!subscriber->pending.empty() && subscriber->pending.back()->getFrameId() != frameId)
+                        subscriber->pending.clear();
+                    subscriber->pending.push_back(frame);
+                    flush(subscriber);
+                }
+                mBatching = false;
+#ifdef CINDER_VIDEOSTREAM_IO_URING
+                if (mUring) mUring->submit();
+#endif
+            });
+        }
+
+    private:
+        // Sends the oldest pending message if the socket is idle and, when it
+        // starts a new frame, the subscriber has credit left and its frame
+        // rate allows it. The rest of a frame's slices and layers go out
+        // under the credit its first message took.
+        void flush(SubscriberRef subscriber){
+            if (subscriber->sending || subscriber->pending.empty()) return;
+            if (!subscriber->flowControl && Clock::now() < subscriber->helloDeadline){
+                wake(subscriber, subscriber->helloDeadline);
+                return;
+            }
+
+            VideoStreamFrameRef next = subscriber->pending.front();
+            if (next->getFrameId() != subscriber->lastFrameId){
+                if (subscriber->flowControl && subscriber->credits == 0) return;
+                if (subscriber->frameInterval > Clock::duration::zero()){
+                    Clock::time_point now = Clock::now();
+                    if (now < subscriber->nextFrameDue){
+                        wake(subscriber, subscriber->nextFrameDue);
+                        return;
+                    }
+                    // Keep an even cadence; after a stall start over from now.
+                    if (now - subscriber->nextFrameDue > subscriber->frameInterval)
+                        subscriber->nextFrameDue = now + subscriber->frameInterval;
+                    else
+                        subscriber->nextFrameDue += subscriber->frameInterval;
+                }
+                subscriber->lastFrameId = next->getFrameId();
+                if (subscriber->flowControl) subscriber->credits--;
+                else subscriber->sentBeforeHello++;
+            }
+            subscriber->pending.pop_front();
+            send(subscriber, next);
+        }
+        // By the time the timer fires newer frames may have replaced the
+        // pending one; the newest is what goes out. A cancelled timer flushes
+        // too, since whatever cancelled it may have found it still armed.
+        void wake(SubscriberRef subscriber, Clock::time_point when){
+            if (subscriber->timerArmed) return;
+            subscriber->timerArmed = true;
+            subscriber->timer.expires_at(when);
+            subscriber->timer.async_wait([this, subscriber](const asio::error_code&){
+                subscriber->timerArmed = false;
+                if (subscriber->socket.is_open()) flush(subscriber);
+            });
+        }
+        void send(SubscriberRef subscriber, VideoStreamFrameRef frame){
+            subscriber->sending = frame;
+#ifdef CINDER_VIDEOSTREAM_IO_URING
+            if (mUring){
+                mUring->send(subscriber->socket.native_handle(), frame, [this, subscriber](int result){
+                    sent(subscriber, result < 0 ? asio::error_code(-result, asio::error::get_system_category()) : asio::error_code(), result < 0 ? 0 : result);
+                });
+                // Sends started by an ACK or a timer go out now; a batch
+                // submits once at its end.
+                if (!mBatching) mUring->submit();
+                return;
+            }
+#endif
+            asio::async_write(subscriber->socket, asio::buffer(frame->getWireData(), frame->getWireSize()), [this, subscriber](const asio::error_code& error, std::size_t bytes){
+                sent(subscriber, error, bytes);
+            });
+        }
+        void sent(SubscriberRef subscriber, const asio::error_code& error, std::size_t bytes){
+            subscriber->sending.reset();
+            if (error){
+                remove(subscriber);
+                return;
+            }
+            mServer.mBytesSent += bytes;
+            mServer.mFramesSent++;
+            flush(subscriber);
+        }
+        void receive(SubscriberRef subscriber){
+            asio::async_read(subscriber->socket, asio::buffer(subscriber->control), [this, subscriber](const asio::error_code& error, std::size_t){
+                VideoStreamControlMessage message;
+                if (error || !message.read(subscriber->control.data())){
+                    remove(subscriber);
+                    return;
+                }
+                if (message.type == VideoStreamControlMessage::HELLO){
+                    // Stop waiting out the HELLO grace period.
+                    asio::error_code e;
+                    subscriber->timer.cancel(e);
+                    subscriber->flowControl = true;
+                    subscriber->credits = message.credits > subscriber->sentBeforeHello ? message.credits - subscriber->sentBeforeHello : 0;
+                    subscriber->maxLayers = message.layers;
+                    if (message.maxFrameRate)
+                        subscriber->frameInterval = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(1.0 / message.maxFrameRate));
+                    if ((message.flags & VideoStreamControlMessage::FLAG_KEYFRAME) && !mLatest.empty()
+                        && subscriber->lastFrameId != mLatest.back()->getFrameId()
+                        && (subscriber->pending.empty() || subscriber->pending.back()->getFrameId() != mLatest.back()->getFrameId())){
+                        subscriber->pending.clear();
+                        for (auto& latest : mLatest)
+                            if (!subscriber->maxLayers || latest->getInfo().layer < subscriber->maxLayers)
+                                subscriber->pending.push_back(latest);
+                    }
+                }
+                else {
+                    subscriber->credits += message.credits;
+                }
+                flush(subscriber);
+                receive(subscriber);
+            });
+        }
+#ifdef CINDER_VIDEOSTREAM_IO_URING
+        void waitForCompletions(){
+            mUringEvents->async_read_some(asio::buffer(&mUringEventCount, sizeof(mUringEventCount)), [this](const asio::error_code& error, std::size_t){
+                if (error) return;
+                // poll() submits whatever its handlers queue.
+                mBatching = true;
+                mUring->poll();
+                mBatching = false;
+                waitForCompletions();
+            });
+        }
+#endif
+        void remove(SubscriberRef subscriber){
+            auto it = std::find(mSubscribers.begin(), mSubscribers.end(), subscriber);
+            if (it == mSubscribers.end()) return;
+            mSubscribers.erase(it);
+            mServer.mSubscriberCount--;
+            asio::error_code e;
+            subscriber->timer.cancel(e);
+            subscriber->socket.close(e);
+        }
+
+        CinderVideoStreamShardedServer& mServer;
+        asio::io_service mIOService;
+        std::unique_ptr<asio::io_service::work> mWork;
+        std::thread mThread;
+        std::vector<SubscriberRef> mSubscribers; // only touched on the shard thread
+        std::deque<VideoStreamFrameRef> mLatest; // every message of the newest frame so far
+        std::size_t mIndex;
+        bool mBatching; // io_uring sends wait for the end of publish() or poll()
+#ifdef CINDER_VIDEOSTREAM_IO_URING
+        std::unique_ptr<VideoStreamUringTransport> mUring;
+        std::unique_ptr<asio::posix::stream_descriptor> mUringEvents;
+        uint64_t mUringEventCount;
+#endif
+    };
+
+    void startAccept(){
+        std::shared_ptr<Shard> shard = mShards[mNextShard++ % mShards.size()];
+        SubscriberRef subscriber(new Subscriber(shard->getIOService()));
+        mAcceptor.async_accept(subscriber->socket, [this, shard, subscriber](const asio::error_code& error){
+            if (!mRunning) return;
+            if (!error){
+                asio::error_code e;
+                subscriber->socket.set_option(asio::ip::tcp::no_delay(true), e);
+                shard->add(subscriber);
+            }
+            startAccept();
+        });
+    }
+    void distributionLoop(){
+        VideoStreamFrameRef frame;
+        while (true){
+            mQueue->wait_and_pop(frame);
+            if (!frame) break;
+            for (auto& shard : mShards) shard->publish(frame);
+        }
+    }
+
+    asio::io_service mIOService;
+    asio::ip::tcp::acceptor mAcceptor;
+    ph::ConcurrentQueue<VideoStreamFrameRef>* mQueue;
+    VideoStreamFramePoolRef mFramePool;
+    VideoStreamStagePlacement mPlacement;
+    std::vector<std::shared_ptr<Shard> > mShards;
+    std::thread mDistributionThread;
+    std::size_t mNextShard;
+    std::atomic<bool> mRunning;
+    std::atomic<uint64_t> mBytesSent;
+    std::atomic<uint64_t> mFramesSent;
+    std::atomic<std::size_t> mSubscriberCount;
+};
+
+#endif
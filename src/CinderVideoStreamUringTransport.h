@@ -0,0 +1,227 @@
+/*
+ CinderVideoStreamUringTransport.h
+
+ Copyright (c) 2015 onewaytheater.us
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy of
+ this software and associated documentation files (the "Software"), to deal in
+ the Software without restriction, including without limitation the rights to
+ use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ of the Software, and to permit persons to whom the Software is furnished to do
+ so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ */
+
+#ifndef CinderVideoStreamUringTransport_CinderVideoStreamUringTransport_h
+#define CinderVideoStreamUringTransport_CinderVideoStreamUringTransport_h
+
+// Linux only, and only when the block is built with
+// CINDER_VIDEOSTREAM_USE_IO_URING and linked against liburing. Everywhere else
+// the streaming classes keep using asio.
+#if defined(__linux__) && defined(CINDER_VIDEOSTREAM_USE_IO_URING)
+#define CINDER_VIDEOSTREAM_IO_URING
+
+#include <liburing.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "CinderVideoStreamFrame.h"
+
+// One io_uring per thread. When given a frame pool its slots are registered
+// as fixed buffers, so sends and receives of pooled frames skip the per-call
+// page pinning; on kernels with IORING_OP_SEND_ZC sends are zero-copy as well.
+// Sends are only queued by send() and go to the kernel together on submit(),
+// so one frame reaches every subscriber of a shard with a single syscall.
+class VideoStreamUringTransport{
+    public:
+
+    // Result is the number of bytes sent or a negative errno.
+    typedef std::function<void(int result)> SendHandler;
+
+    // Throws std::runtime_error when io_uring is not available so that the
+    // caller can fall back to asio.
+    VideoStreamUringTransport(VideoStreamFramePoolRef pool = VideoStreamFramePoolRef(), unsigned entries = 512)
+                                :mPool(pool), mFixedBuffers(false), mZeroCopy(false), mEventFd(-1), mNextTag(1){
+        int result = io_uring_queue_init(entries, &mRing, 0);
+        if (result < 0)
+            throw std::runtime_error(std::string("io_uring_queue_init: ") + strerror(-result));
+
+        if (mPool){
+            std::vector<iovec> iovecs(mPool->getNumSlots());
+            for (std::size_t i = 0; i < iovecs.size(); i++){
+                iovecs[i].iov_base = mPool->getSlot((int)i);
+                iovecs[i].iov_len = mPool->getSlotSize();
+            }
+            mFixedBuffers = io_uring_register_buffers(&mRing, iovecs.data(), (unsigned)iovecs.size()) == 0;
+        }
+#ifdef IORING_RECVSEND_FIXED_BUF
+        io_uring_probe* probe = io_uring_get_probe_ring(&mRing);
+        if (probe){
+            mZeroCopy = io_uring_opcode_supported(probe, IORING_OP_SEND_ZC);
+            io_uring_free_probe(probe);
+        }
+#endif
+    }
+    ~VideoStreamUringTransport(){
+        io_uring_queue_exit(&mRing);
+        if (mEventFd >= 0) close(mEventFd);
+    }
+
+    bool isZeroCopy() const { return mZeroCopy; }
+    bool hasFixedBuffers() const { return mFixedBuffers; }
+
+    // Becomes readable whenever completions are waiting; lets an io_service
+    // drive poll().
+    int getEventFd(){
+        if (mEventFd < 0){
+            mEventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            if (mEventFd < 0 || io_uring_register_eventfd(&mRing, mEventFd) < 0)
+                throw std::runtime_error("io_uring_register_eventfd failed");
+        }
+        return mEventFd;
+    }
+
+    // Queues the whole wire buffer of frame for fd. Short sends are resumed
+    // internally; handler runs once with the final result.
+    void send(int fd, VideoStreamFrameRef frame, SendHandler handler){
+        uint64_t tag = mNextTag++;
+        Operation& op = mOperations[tag];
+        op.fd = fd;
+        op.frame = frame;
+        op.handler = handler;
+        prepareSend(tag, op);
+    }
+    void submit(){
+        io_uring_submit(&mRing);
+    }
+
+    // Runs the handlers of every finished send and resubmits partial ones.
+    void poll(){
+        io_uring_cqe* cqe;
+        while (io_uring_peek_cqe(&mRing, &cqe) == 0){
+            uint64_t tag = cqe->user_data;
+            int result = cqe->res;
+            unsigned flags = cqe->flags;
+            io_uring_cqe_seen(&mRing, cqe);
+            complete(tag, result, flags);
+        }
+        submit();
+    }
+
+    // Blocking receive of exactly size bytes. Pass the frame's buffer index to
+    // read into a registered slot.
+    void read(int fd, uint8_t* data, std::size_t size, int bufferIndex = -1){
+        std::size_t offset = 0;
+        while (offset < size){
+            io_uring_sqe* sqe = getSqe();
+            if (bufferIndex >= 0 && mFixedBuffers)
+                io_uring_prep_read_fixed(sqe, fd, data + offset, (unsigned)(size - offset), 0, bufferIndex);
+            else
+                io_uring_prep_recv(sqe, fd, data + offset, size - offset, MSG_WAITALL);
+            sqe->user_data = 0;
+            io_uring_submit(&mRing);
+
+            io_uring_cqe* cqe;
+            int result = io_uring_wait_cqe(&mRing, &cqe);
+            if (result == 0){
+                result = cqe->res;
+                io_uring_cqe_seen(&mRing, cqe);
+            }
+            if (result == 0)
+                throw std::runtime_error("Connection closed by peer");
+            if (result < 0)
+                throw std::runtime_error(std::string("io_uring read: ") + strerror(-result));
+            offset += result;
+        }
+    }
+
+private:
+    struct Operation{
+        Operation():fd(-1), offset(0), notifications(0), finished(false){}
+        int fd;
+        VideoStreamFrameRef frame;   // keeps the buffer alive until the kernel is done with it
+        SendHandler handler;
+        std::size_t offset;
+        int notifications;
+        bool finished;
+    };
+
+    io_uring_sqe* getSqe(){
+        io_uring_sqe* sqe = io_uring_get_sqe(&mRing);
+        while (!sqe){
+            io_uring_submit(&mRing);
+            sqe = io_uring_get_sqe(&mRing);
+        }
+        return sqe;
+    }
+    void prepareSend(uint64_t tag, Operation& op){
+        io_uring_sqe* sqe = getSqe();
+        const uint8_t* data = op.frame->getWireData() + op.offset;
+        std::size_t size = op.frame->getWireSize() - op.offset;
+#ifdef IORING_RECVSEND_FIXED_BUF
+        if (mZeroCopy && mFixedBuffers && op.frame->getBufferIndex() >= 0)
+            io_uring_prep_send_zc_fixed(sqe, op.fd, data, size, MSG_NOSIGNAL | MSG_WAITALL, 0, op.frame->getBufferIndex());
+        else if (mZeroCopy)
+            io_uring_prep_send_zc(sqe, op.fd, data, size, MSG_NOSIGNAL | MSG_WAITALL, 0);
+        else
+#endif
+            io_uring_prep_send(sqe, op.fd, data, size, MSG_NOSIGNAL | MSG_WAITALL);
+        sqe->user_data = tag;
+    }
+    void complete(uint64_t tag, int result, unsigned flags){
+        auto it = mOperations.find(tag);
+        if (it == mOperations.end()) return;
+        Operation& op = it->second;
+
+#ifdef IORING_RECVSEND_FIXED_BUF
+        // Zero-copy sends report twice: once for the send, once when the
+        // kernel releases the buffer.
+        if (flags & IORING_CQE_F_NOTIF){
+            op.notifications--;
+            if (op.finished && op.notifications == 0) mOperations.erase(it);
+            return;
+        }
+        if (flags & IORING_CQE_F_MORE) op.notifications++;
+#endif
+        if (result > 0 && op.offset + result < op.frame->getWireSize()){
+            op.offset += result;
+            prepareSend(tag, op);
+            return;
+        }
+
+        op.finished = true;
+        SendHandler handler;
+        std::swap(handler, op.handler);
+        int sent = result < 0 ? result : (int)op.frame->getWireSize();
+        if (op.notifications == 0) mOperations.erase(it);
+        if (handler) handler(sent);
+    }
+
+    io_uring mRing;
+    VideoStreamFramePoolRef mPool;
+    bool mFixedBuffers;
+    bool mZeroCopy;
+    int mEventFd;
+    uint64_t mNextTag;
+    std::unordered_map<uint64_t, Operation> mOperations;
+};
+
+#endif
+#endif
@@ -77,7 +77,11 @@ namespace ph {
             popped_value=mQueue.front();
             mQueue.pop();
         }
-        std::size_t size() const { return mQueue.size(); }
+        std::size_t size() const
+        {
+            std::unique_lock<std::mutex> lock(mMutex);
+            return mQueue.size();
+        }
     private:
         std::queue<Data>		mQueue;
         mutable std::mutex	mMutex;
@@ -56,6 +56,7 @@ private:
     void threadLoop();
     
     std::shared_ptr<std::thread> mClientThreadRef;
+    std::shared_ptr<CinderVideoStreamClientUint8> mClient;
     
     uint8_t * mData;
     SurfaceRef mStreamSurface;
@@ -68,15 +69,15 @@ private:
 
 void _TBOX_PREFIX_App::threadLoop()
 {
-    while (true) {
-        try {
-            std::shared_ptr<CinderVideoStreamClientUint8> s = std::shared_ptr<CinderVideoStreamClientUint8>(new CinderVideoStreamClientUint8("localhost","3333"));
-            s.get()->setup(queueFromServer, mClientStatus, WIDTH*HEIGHT*3);  //3 - for RGB mode
-            s.get()->run();
-        }
-        catch (std::exception& e) {
-            std::cerr << "Exception: " << e.what() << "\n";
-        }
+    // One client for the whole session keeps its buffer and resolved
+    // endpoints across reconnects.
+    mClient->setup(queueFromServer, mClientStatus, WIDTH*HEIGHT*3);  //3 - for RGB mode
+    // Reconnects by itself; returns once shutdown() stops the client.
+    try {
+        mClient->run();
+    }
+    catch (std::exception& e) {
+        std::cerr << "Exception: " << e.what() << "\n";
     }
 }
 
@@ -90,8 +91,8 @@ void _TBOX_PREFIX_App::setup()
     //setFrameRate(30);
     mClientStatus = new std::string();
     queueFromServer = new ph::ConcurrentQueue<uint8_t*>();
+    mClient = std::shared_ptr<CinderVideoStreamClientUint8>(new CinderVideoStreamClientUint8("localhost","3333"));
     mClientThreadRef = std::shared_ptr<std::thread>(new thread(boost::bind(&_TBOX_PREFIX_App::threadLoop, this)));
-    mClientThreadRef->detach();
     mStreamSurface = Surface::create(WIDTH, HEIGHT, true, SurfaceChannelOrder::RGB);
     
     mStatus.assign("Starting");
@@ -104,7 +105,9 @@ void _TBOX_PREFIX_App::keyDown( KeyEvent event )
 }
 
 void _TBOX_PREFIX_App::shutdown(){
-    if (mData) delete mData;
+    // mData points into the client's mapped receive buffer; never delete it.
+    mClient->stop();
+    if (mClientThreadRef && mClientThreadRef->joinable()) mClientThreadRef->join();
     if (queueFromServer) delete queueFromServer;
 }
 void _TBOX_PREFIX_App::update()
@@ -114,6 +117,8 @@ void _TBOX_PREFIX_App::update()
         mTexture = gl::Texture::create( *mStreamSurface );
     }
     mStatus.assign("Client: ").append(std::to_string((int)getFrameRate())).append(" fps: ").append(*mClientStatus);
+    if (mClient->getTimeToFirstFrame() >= 0)
+        mStatus.append(" first frame in ").append(std::to_string((int)(mClient->getTimeToFirstFrame() * 1000.0))).append(" ms");
 }
 
 void _TBOX_PREFIX_App::draw()